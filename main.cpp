@@ -8,6 +8,22 @@
 #include <stack>
 #include <limits>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string>
+#include <map>
+#include <signal.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <SDL2/SDL.h>
 
@@ -18,6 +34,12 @@ uint16_t ADDR = 0;
 std::stack<int> sub_stack;
 uint16_t delay_timer = 0;
 uint16_t sound_timer = 0;
+uint64_t instructions_executed = 0;
+uint64_t frames_presented = 0;
+uint64_t blocks_dispatched = 0;
+
+/* -b N: run N instructions as fast as possible without presenting, then report */
+long benchmark_instructions = 0;
 
 uint32_t* pixels = NULL;
 SDL_Renderer* renderer = NULL;
@@ -47,11 +69,184 @@ SDL_Texture* screen_texture = NULL;
 
 #define DEBUG 0
 
+#ifndef DEBUGGER
+#define DEBUGGER 0
+#endif
+
 #define DEBUG_PRINT(format, ...) \
   if(DEBUG) {fprintf (stderr, format __VA_OPT__(,) __VA_ARGS__);}
 
+/* Frame capture.
+   Every presented frame is streamed as a mono YUV4MPEG2 picture (one byte per pixel).
+   A run of identical frames is written once, with an XREPEAT=n frame parameter
+   counting the extra copies. Frames are emitted on every 00E0/DXYN, not at a fixed
+   rate, so the F60:1 in the header is nominal. Writing happens on a separate
+   thread. When more than CAPTURE_QUEUE_LIMIT frames are waiting, a regular file
+   holds emulation up until the writer catches up, so its output is complete.
+   A pipe or FIFO instead drops frames rather than stall on a slow reader, and the
+   next frame written carries an XDROPPED=n parameter so the gap is visible. */
+#define CAPTURE_QUEUE_LIMIT 1024
+
+struct CaptureFrame {
+	uint8_t luma[WIDTH*HEIGHT];
+	uint32_t repeats;
+	uint64_t dropped;	/* frames lost just before this one */
+};
+
+FILE* capture_file = NULL;
+std::thread capture_thread;
+std::mutex capture_mutex;
+std::condition_variable capture_cond;
+std::condition_variable capture_space;
+bool capture_blocking = false;
+std::deque<CaptureFrame*> capture_queue;
+bool capture_done = false;
+CaptureFrame* capture_pending = NULL;
+uint64_t capture_dropped = 0;
+uint64_t capture_dropped_run = 0;
+
+void capture_writer()
+{
+	bool failed = false;
+	std::unique_lock<std::mutex> lock(capture_mutex);
+
+	while(true) {
+		capture_cond.wait(lock, [] { return !capture_queue.empty() || capture_done; });
+		if(capture_queue.empty()) {
+			break;
+		}
+
+		std::deque<CaptureFrame*> batch;
+		batch.swap(capture_queue);
+		lock.unlock();
+		capture_space.notify_one();
+
+		for(CaptureFrame* frame : batch) {
+			if(!failed) {
+				fputs("FRAME", capture_file);
+				if(frame->dropped > 0) {
+					fprintf(capture_file, " XDROPPED=%llu", (unsigned long long)frame->dropped);
+				}
+				if(frame->repeats > 0) {
+					fprintf(capture_file, " XREPEAT=%u", frame->repeats);
+				}
+				fputc('\n', capture_file);
+				if(fwrite(frame->luma, sizeof(frame->luma), 1, capture_file) != 1) {
+					fprintf(stderr, "capture: write failed, dropping remaining frames\n");
+					failed = true;
+				}
+			}
+			delete frame;
+		}
+
+		lock.lock();
+	}
+
+	fflush(capture_file);
+}
+
+void capture_flush_pending(bool wait)
+{
+	if(capture_pending == NULL) {
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(capture_mutex);
+		if(wait) {
+			capture_space.wait(lock, [] { return capture_queue.size() < CAPTURE_QUEUE_LIMIT; });
+		}
+		if(capture_queue.size() < CAPTURE_QUEUE_LIMIT) {
+			capture_pending->dropped = capture_dropped_run;
+			capture_dropped_run = 0;
+			capture_queue.push_back(capture_pending);
+			capture_pending = NULL;
+		}
+	}
+	capture_cond.notify_one();
+
+	if(capture_pending != NULL) {
+		capture_dropped += 1 + capture_pending->repeats;
+		capture_dropped_run += 1 + capture_pending->repeats;
+		delete capture_pending;
+		capture_pending = NULL;
+	}
+}
+
+void capture_close()
+{
+	if(capture_file == NULL) {
+		return;
+	}
+
+	capture_flush_pending(true);
+	{
+		std::lock_guard<std::mutex> lock(capture_mutex);
+		capture_done = true;
+	}
+	capture_cond.notify_one();
+	capture_thread.join();
+
+	fclose(capture_file);
+	capture_file = NULL;
+
+	if(capture_dropped > 0) {
+		fprintf(stderr, "capture: dropped %llu frames, the reader fell behind\n", (unsigned long long)capture_dropped);
+	}
+}
+
+bool capture_open(const char* filename)
+{
+	capture_file = fopen(filename, "wb");
+	if(capture_file == NULL) {
+		perror(filename);
+		return false;
+	}
+	setvbuf(capture_file, NULL, _IOFBF, 1 << 16);
+
+	struct stat info;
+	capture_blocking = fstat(fileno(capture_file), &info) == 0 && S_ISREG(info.st_mode);
+
+	/* a reader going away should end the capture, not the emulator */
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(capture_file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 Cmono\n", WIDTH, HEIGHT);
+	capture_thread = std::thread(capture_writer);
+	atexit(capture_close);
+	return true;
+}
+
+void capture_frame(const uint32_t* pixels)
+{
+	uint8_t luma[WIDTH*HEIGHT];
+
+	for(int i = 0; i < WIDTH*HEIGHT; i++) {
+		luma[i] = pixels[i] ? 0xFF : 0x00;
+	}
+
+	/* DXYN often redraws what is already on screen, only count those */
+	if(capture_pending != NULL && memcmp(capture_pending->luma, luma, sizeof(luma)) == 0) {
+		capture_pending->repeats++;
+		return;
+	}
+
+	capture_flush_pending(capture_blocking);
+	capture_pending = new CaptureFrame;
+	memcpy(capture_pending->luma, luma, sizeof(luma));
+	capture_pending->repeats = 0;
+}
+
 void update_window()
 {
+	frames_presented++;
+
+	if(capture_file != NULL) {
+		capture_frame(pixels);
+	}
+	if(benchmark_instructions > 0) {
+		return;
+	}
+
 	SDL_RenderClear(renderer);
 	SDL_UpdateTexture(screen_texture, NULL, pixels, WIDTH * 4);
 	SDL_RenderCopy(renderer, screen_texture, NULL, NULL);
@@ -60,6 +255,29 @@ void update_window()
 
 
 
+/* While FX0A waits, the main loop stops dispatching and fills in key_press
+   with the next CHIP-8 key pressed. */
+int key_press = -1;
+bool waiting_for_key = false;
+uint8_t key_wait_register = 0;
+
+int key_from_scancode(int scancode)
+{
+	static const int scancodes[16] = {
+		SDL_SCANCODE_0, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,
+		SDL_SCANCODE_4, SDL_SCANCODE_5, SDL_SCANCODE_6, SDL_SCANCODE_7,
+		SDL_SCANCODE_8, SDL_SCANCODE_9, SDL_SCANCODE_A, SDL_SCANCODE_B,
+		SDL_SCANCODE_C, SDL_SCANCODE_D, SDL_SCANCODE_E, SDL_SCANCODE_F,
+	};
+
+	for(int key = 0; key <= 0xF; key++) {
+		if(scancodes[key] == scancode) {
+			return key;
+		}
+	}
+	return -1;
+}
+
 void print_registers() {
 	for(int i = 0; i <= 0xF; i++) {
 		printf("Register V%X: %d\n", i, REG(i));
@@ -86,6 +304,14 @@ struct Instruction {
 	uint8_t a, b;
 };
 
+/* Bad or unsupported instructions end the run through exit() rather than an
+   assert, so atexit handlers such as capture_close() still get to flush. */
+[[noreturn]] void bad_instruction(Instruction inst)
+{
+	fprintf(stderr, "Bad or unimplemented instruction %02X%02X at %03X\n", inst.a, inst.b, PC);
+	exit(1);
+}
+
 Instruction fetch(int PC) {
 	DEBUG_PRINT("FETCH[%d,%d]: %04X\n", PC, PC+1, (memory[PC+1] | memory[PC] << 8));
 	return Instruction {memory[PC], memory[PC+1]};
@@ -159,7 +385,7 @@ OpCode decode(Instruction inst)
 			} else if (inst.b == 0xEE) { /* 00EE Return from a subroutine */
 				return OP_00EE;
 			} else {
-				assert(false);
+				bad_instruction(inst);
 			}
 		}
 		break;
@@ -198,7 +424,7 @@ OpCode decode(Instruction inst)
 			} else if((inst.b & 0xF) == 0xE) {
 				return OP_8XYE;
 			} else {
-				assert(false);
+				bad_instruction(inst);
 			}
 		}
 		break;
@@ -216,7 +442,7 @@ OpCode decode(Instruction inst)
 			} else if(inst.b == 0xA1) {
 				return OP_EXA1;
 			} else {
-				assert(false);
+				bad_instruction(inst);
 			}
 		} break;
 		case 0xF0: {
@@ -239,16 +465,698 @@ OpCode decode(Instruction inst)
 			} else if(inst.b == 0x65) { /* FX65 Fill registers V0 to VX inclusive with the values stored in memory starting at address I. I is set to I + X + 1 after operation²  */
 				return OP_FX65;
 			} else {
-				assert(false);
+				bad_instruction(inst);
 			}
 		} break;
 	default:
-		printf("No such opcode (%X%X) implemented yet.\n", inst.a, inst.b);
-		assert(false);
+		fprintf(stderr, "No such opcode (%X%X) implemented yet.\n", inst.a, inst.b);
+		bad_instruction(inst);
 		break;
 	}
 }
 
+#ifdef CHIP8_AOT
+/* Blocks recompiled ahead of time by recomp (make aot ROM=...). A block runs in
+   place of the interpreter as long as the bytes it was translated from are
+   untouched; FX33/FX55 stores into them switch that block back off. */
+struct AotBlock {
+	uint16_t start, end;
+	int (*run)();
+};
+
+#include CHIP8_AOT
+
+int (*aot_entry[0x1000])() = {NULL};
+bool aot_code[0x1000] = {false};
+
+void aot_load(int rom_size)
+{
+	if(rom_size != aot_rom_size || memcmp(&memory[0x200], aot_rom, aot_rom_size) != 0) {
+		fprintf(stderr, "aot: rom differs from %s, interpreting only\n", aot_rom_path);
+		return;
+	}
+
+	for(int i = 0; i < aot_block_count; i++) {
+		aot_entry[aot_blocks[i].start] = aot_blocks[i].run;
+		for(int addr = aot_blocks[i].start; addr < aot_blocks[i].end; addr++) {
+			aot_code[addr] = true;
+		}
+	}
+}
+
+void aot_invalidate(int addr)
+{
+	if(addr >= 0x1000 || !aot_code[addr]) {
+		return;
+	}
+
+	for(int i = 0; i < aot_block_count; i++) {
+		if(addr >= aot_blocks[i].start && addr < aot_blocks[i].end) {
+			aot_entry[aot_blocks[i].start] = NULL;
+		}
+	}
+}
+#endif
+
+/* Control socket.
+   A supervisor connects to a Unix domain socket and sends one command per line;
+   any number of lines may be pipelined and each gets a one line reply, in order.
+   Socket I/O happens on its own thread, the emulation loop only picks up parsed
+   lines between instructions. Memory and the framebuffer are handed over
+   through a shared memory segment instead of the socket. */
+struct ControlSnapshot {
+	uint32_t sequence;	/* odd while a snapshot is being written */
+	uint16_t pc, addr;
+	uint8_t registers[16];
+	uint8_t memory[0x1000];
+	uint32_t pixels[WIDTH*HEIGHT];
+};
+
+#define CONTROL_LINE_LIMIT 1024
+#define CONTROL_OUTPUT_LIMIT (1 << 20)
+
+struct ControlMessage {
+	int client;
+	std::string text;
+};
+
+struct ControlClient {
+	int fd;
+	std::string in, out;
+};
+
+int control_fd = -1;
+int control_wake[2] = {-1, -1};
+std::mutex control_mutex;
+std::vector<ControlMessage> control_commands;
+std::vector<ControlMessage> control_replies;
+std::atomic<bool> control_pending(false);
+std::string control_socket_path;
+
+/* only touched by the emulation thread */
+std::deque<ControlMessage> control_deferred;
+ControlSnapshot* control_snapshot = NULL;
+char control_shm_name[64] = {0};
+bool paused = false;
+long step_budget = 0;
+int step_client = -1;
+uint16_t control_keys = 0;
+
+void control_loop()
+{
+	std::map<int, ControlClient> clients;
+	int next_client = 0;
+
+	while(true) {
+		std::vector<pollfd> fds;
+		std::vector<int> ids;
+
+		fds.push_back({control_fd, POLLIN, 0});
+		fds.push_back({control_wake[0], POLLIN, 0});
+		for(auto& entry : clients) {
+			short events = POLLIN | (entry.second.out.empty() ? 0 : POLLOUT);
+			fds.push_back({entry.second.fd, events, 0});
+			ids.push_back(entry.first);
+		}
+
+		if(poll(fds.data(), fds.size(), -1) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("control: poll");
+			return;
+		}
+
+		if(fds[0].revents & POLLIN) {
+			int fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(fd >= 0) {
+				clients[next_client++] = ControlClient {fd, "", ""};
+			}
+		}
+
+		if(fds[1].revents & POLLIN) {
+			char drain[64];
+			while(read(control_wake[0], drain, sizeof(drain)) > 0) {}
+
+			std::vector<ControlMessage> replies;
+			{
+				std::lock_guard<std::mutex> lock(control_mutex);
+				replies.swap(control_replies);
+			}
+			for(ControlMessage& reply : replies) {
+				auto it = clients.find(reply.client);
+				if(it == clients.end()) {
+					continue;
+				}
+				it->second.out += reply.text;
+
+				/* a client that keeps asking without reading gets dropped */
+				if(it->second.out.size() > CONTROL_OUTPUT_LIMIT) {
+					close(it->second.fd);
+					clients.erase(it);
+				}
+			}
+		}
+
+		std::vector<ControlMessage> commands;
+
+		for(size_t i = 0; i < ids.size(); i++) {
+			auto it = clients.find(ids[i]);
+			if(it == clients.end()) {
+				continue;
+			}
+			ControlClient& client = it->second;
+			short revents = fds[i + 2].revents;
+			bool closed = (revents & (POLLERR | POLLHUP)) != 0;
+
+			if(revents & POLLIN) {
+				char buffer[4096];
+				ssize_t got = read(client.fd, buffer, sizeof(buffer));
+				if(got > 0) {
+					client.in.append(buffer, got);
+				} else if(got == 0 || errno != EAGAIN) {
+					closed = true;
+				}
+
+				size_t newline;
+				while((newline = client.in.find('\n')) != std::string::npos) {
+					commands.push_back(ControlMessage {ids[i], client.in.substr(0, newline)});
+					client.in.erase(0, newline + 1);
+				}
+
+				/* nothing useful is that long, don't buffer it forever */
+				if(client.in.size() > CONTROL_LINE_LIMIT) {
+					closed = true;
+				}
+			}
+
+			if(!client.out.empty() && (revents & POLLOUT)) {
+				ssize_t sent = write(client.fd, client.out.data(), client.out.size());
+				if(sent > 0) {
+					client.out.erase(0, sent);
+				}
+			}
+
+			if(closed) {
+				close(client.fd);
+				clients.erase(ids[i]);
+			}
+		}
+
+		/* a whole read's worth of pipelined lines goes over in one batch */
+		if(!commands.empty()) {
+			std::lock_guard<std::mutex> lock(control_mutex);
+			control_commands.insert(control_commands.end(), commands.begin(), commands.end());
+			control_pending.store(true, std::memory_order_release);
+		}
+	}
+}
+
+void control_close()
+{
+	if(!control_socket_path.empty()) {
+		unlink(control_socket_path.c_str());
+	}
+	if(control_shm_name[0] != 0) {
+		shm_unlink(control_shm_name);
+	}
+}
+
+bool control_open(const char* path)
+{
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return false;
+	}
+	strcpy(address.sun_path, path);
+
+	control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink(path);
+	if(control_fd < 0 || bind(control_fd, (sockaddr*)&address, sizeof(address)) < 0) {
+		perror(path);
+		return false;
+	}
+
+	/* from here on there is something to clean up, whichever step fails */
+	control_socket_path = path;
+	snprintf(control_shm_name, sizeof(control_shm_name), "/chip8-%d", (int)getpid());
+	atexit(control_close);
+
+	if(listen(control_fd, 8) < 0) {
+		perror(path);
+		return false;
+	}
+
+	int shm_fd = shm_open(control_shm_name, O_CREAT | O_RDWR, 0600);
+	if(shm_fd < 0 || ftruncate(shm_fd, sizeof(ControlSnapshot)) < 0) {
+		perror(control_shm_name);
+		return false;
+	}
+	control_snapshot = (ControlSnapshot*)mmap(NULL, sizeof(ControlSnapshot), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	if(control_snapshot == MAP_FAILED) {
+		perror(control_shm_name);
+		return false;
+	}
+
+	if(pipe2(control_wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+		perror("pipe");
+		return false;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	std::thread(control_loop).detach();
+	return true;
+}
+
+void control_snapshot_write(bool whole)
+{
+	uint32_t sequence = control_snapshot->sequence;
+
+	__atomic_store_n(&control_snapshot->sequence, sequence + 1, __ATOMIC_RELAXED);
+	/* keep the copies below from being seen before the odd sequence */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if(whole) {
+		control_snapshot->pc = PC;
+		control_snapshot->addr = ADDR;
+		memcpy(control_snapshot->registers, registers, sizeof(registers));
+		memcpy(control_snapshot->memory, memory, sizeof(memory));
+	}
+	memcpy(control_snapshot->pixels, pixels, sizeof(control_snapshot->pixels));
+	__atomic_store_n(&control_snapshot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Runs one command line and returns its reply. */
+std::string control_execute(int client, const char* line)
+{
+	char verb[16] = {0}, arg[16] = {0}, data[512] = {0};
+	char reply[512];
+	long a = 0, b = 0;
+
+	if(sscanf(line, "%15s", verb) != 1) {
+		return "ERR empty command\n";
+	}
+
+	if(strcmp(verb, "pause") == 0) {
+		paused = true;
+		step_budget = 0;
+	} else if(strcmp(verb, "resume") == 0) {
+		paused = false;
+		step_budget = 0;
+	} else if(strcmp(verb, "step") == 0) {
+		if(sscanf(line, "%*s %li", &a) != 1) {
+			a = 1;
+		}
+		if(a <= 0) {
+			return "ERR step count must be positive\n";
+		}
+		if(step_budget > 0) {
+			return "ERR a step is still waiting for a key\n";
+		}
+		/* the reply is sent once the steps have run */
+		paused = true;
+		step_budget = a;
+		step_client = client;
+		return "";
+	} else if(strcmp(verb, "keys") == 0) {
+		if(sscanf(line, "%*s %li", &a) != 1 || a < 0 || a > 0xFFFF) {
+			return "ERR usage: keys MASK\n";
+		}
+		control_keys = a;
+	} else if(strcmp(verb, "peek") == 0) {
+		if(sscanf(line, "%*s %li %li", &a, &b) != 2 || a < 0 || b <= 0 || b > 128 || a + b > (long)sizeof(memory)) {
+			return "ERR usage: peek ADDR LEN (LEN <= 128, use snapshot for more)\n";
+		}
+		std::string out = "OK";
+		for(long i = a; i < a + b; i++) {
+			snprintf(reply, sizeof(reply), " %02X", memory[i]);
+			out += reply;
+		}
+		return out + "\n";
+	} else if(strcmp(verb, "poke") == 0) {
+		if(sscanf(line, "%*s %li %511[0-9A-Fa-f]", &a, data) != 2 || strlen(data) % 2 != 0 || a < 0 || a + (long)strlen(data) / 2 > (long)sizeof(memory)) {
+			return "ERR usage: poke ADDR HEXBYTES\n";
+		}
+		for(size_t i = 0; i < strlen(data) / 2; i++) {
+			unsigned int byte;
+			sscanf(&data[i * 2], "%2x", &byte);
+			memory[a + i] = byte;
+#ifdef CHIP8_AOT
+			aot_invalidate(a + i);
+#endif
+		}
+	} else if(strcmp(verb, "reg") == 0) {
+		int fields = sscanf(line, "%*s %15s %li", arg, &b);
+		if(fields == 2) {
+			if(strcmp(arg, "PC") == 0) {
+				/* fetch() reads PC and PC + 1 */
+				if(b < 0 || b >= 0xFFF) {
+					return "ERR PC must be below 0xFFF\n";
+				}
+				PC = b;
+			} else if(strcmp(arg, "I") == 0) {
+				if(b < 0 || b > 0xFFF) {
+					return "ERR I must be at most 0xFFF\n";
+				}
+				ADDR = b;
+			} else if(arg[0] == 'V' && strlen(arg) == 2 && isxdigit(arg[1])) {
+				if(b < 0 || b > 0xFF) {
+					return "ERR registers hold a byte\n";
+				}
+				REG(strtol(&arg[1], NULL, 16)) = b;
+			} else {
+				return "ERR unknown register\n";
+			}
+		} else if(fields != -1 && fields != 0) {
+			return "ERR usage: reg [NAME VALUE]\n";
+		}
+		std::string out;
+		snprintf(reply, sizeof(reply), "OK PC=%03X I=%03X SP=%d DT=%d ST=%d", PC, ADDR, (int)sub_stack.size(), delay_timer, sound_timer);
+		out = reply;
+		for(int i = 0; i <= 0xF; i++) {
+			snprintf(reply, sizeof(reply), " V%X=%02X", i, REG(i));
+			out += reply;
+		}
+		return out + "\n";
+	} else if(strcmp(verb, "snapshot") == 0 || strcmp(verb, "screenshot") == 0) {
+		control_snapshot_write(strcmp(verb, "snapshot") == 0);
+		snprintf(reply, sizeof(reply), "OK %s %u\n", control_shm_name, control_snapshot->sequence);
+		return reply;
+	} else if(strcmp(verb, "stats") == 0) {
+		snprintf(reply, sizeof(reply), "OK instructions=%llu frames=%llu blocks=%llu paused=%d\n",
+			(unsigned long long)instructions_executed, (unsigned long long)frames_presented,
+			(unsigned long long)blocks_dispatched, paused);
+		return reply;
+	} else {
+		return "ERR unknown command\n";
+	}
+
+	return "OK\n";
+}
+
+void control_reply(std::vector<ControlMessage>& replies)
+{
+	if(replies.empty()) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(control_mutex);
+		control_replies.insert(control_replies.end(), replies.begin(), replies.end());
+	}
+	if(write(control_wake[1], "", 1) < 0) {
+		/* the pipe is full, the control thread is already being woken */
+	}
+}
+
+/* Runs queued commands. A step stops the batch: the commands behind it wait
+   until the steps have run so they see the state the step left behind. */
+void control_service()
+{
+	if(control_pending.load(std::memory_order_acquire)) {
+		std::lock_guard<std::mutex> lock(control_mutex);
+		control_deferred.insert(control_deferred.end(), control_commands.begin(), control_commands.end());
+		control_commands.clear();
+		control_pending.store(false, std::memory_order_relaxed);
+	}
+
+	std::vector<ControlMessage> replies;
+
+	/* a step held up by FX0A lets commands through, or 'keys' could never arrive */
+	while((step_budget == 0 || waiting_for_key) && !control_deferred.empty()) {
+		ControlMessage command = control_deferred.front();
+		control_deferred.pop_front();
+
+		std::string text = control_execute(command.client, command.text.c_str());
+		if(!text.empty()) {
+			replies.push_back(ControlMessage {command.client, text});
+		}
+	}
+
+	control_reply(replies);
+}
+
+void control_step_done()
+{
+	char reply[32];
+	snprintf(reply, sizeof(reply), "OK PC=%03X\n", PC);
+
+	std::vector<ControlMessage> replies;
+	replies.push_back(ControlMessage {step_client, reply});
+	control_reply(replies);
+
+	step_client = -1;
+	control_service();
+}
+
+#if DEBUGGER
+/* Interactive debugger (make debug).
+   Breakpoints and watchpoints are bitmaps with one bit per memory address.
+   Breakpoints are looked at once per dispatch from the main loop, which is a
+   whole block in an AOT build, so setting one turns off the compiled blocks
+   covering it; deleting the last breakpoint in a block turns it back on, unless
+   its bytes have been overwritten since. Watchpoints are only looked at by the
+   instructions that read or write memory through I. With none set, each check
+   is a single compare. */
+uint64_t breakpoints[0x1000 / 64] = {0};
+uint64_t watch_reads[0x1000 / 64] = {0};
+uint64_t watch_writes[0x1000 / 64] = {0};
+int breakpoint_count = 0;
+int watchpoint_count = 0;
+bool debugger_break = false;
+long debugger_steps = 0;
+
+bool bit_test(const uint64_t* bitmap, int addr)
+{
+	return addr >= 0 && addr < 0x1000 && (bitmap[addr / 64] >> (addr % 64) & 0x1);
+}
+
+/* Sets or clears one bit, returns whether it changed. */
+bool bit_set(uint64_t* bitmap, int addr, bool value)
+{
+	if(addr < 0 || addr >= 0x1000 || bit_test(bitmap, addr) == value) {
+		return false;
+	}
+	bitmap[addr / 64] ^= (uint64_t)1 << (addr % 64);
+	return true;
+}
+
+void watch_check(const uint64_t* bitmap, int addr, int length, const char* access)
+{
+	for(int i = addr; i < addr + length; i++) {
+		if(bit_test(bitmap, i)) {
+			printf("watchpoint: %s of %03X by instruction at %03X\n", access, i, PC);
+			debugger_break = true;
+			return;
+		}
+	}
+}
+
+void disassemble(int addr, char* out, size_t size)
+{
+	uint8_t a = memory[addr & 0xFFF], b = memory[(addr + 1) & 0xFFF];
+	int x = a & 0xF, y = b >> 4, n = b & 0xF;
+	int nnn = b | x << 8;
+
+	switch(a & 0xF0) {
+		case 0x00:
+			if(a == 0x00 && b == 0xE0) {
+				snprintf(out, size, "CLS");
+			} else if(a == 0x00 && b == 0xEE) {
+				snprintf(out, size, "RET");
+			} else {
+				snprintf(out, size, "SYS  %03X", nnn);
+			}
+			return;
+		case 0x10: snprintf(out, size, "JP   %03X", nnn); return;
+		case 0x20: snprintf(out, size, "CALL %03X", nnn); return;
+		case 0x30: snprintf(out, size, "SE   V%X, %02X", x, b); return;
+		case 0x40: snprintf(out, size, "SNE  V%X, %02X", x, b); return;
+		case 0x50: snprintf(out, size, "SE   V%X, V%X", x, y); return;
+		case 0x60: snprintf(out, size, "LD   V%X, %02X", x, b); return;
+		case 0x70: snprintf(out, size, "ADD  V%X, %02X", x, b); return;
+		case 0x80: {
+			static const char* ops[16] = {"LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN",
+				NULL, NULL, NULL, NULL, NULL, NULL, "SHL", NULL};
+			if(ops[n] != NULL) {
+				snprintf(out, size, "%-4s V%X, V%X", ops[n], x, y);
+				return;
+			}
+		} break;
+		case 0x90: snprintf(out, size, "SNE  V%X, V%X", x, y); return;
+		case 0xA0: snprintf(out, size, "LD   I, %03X", nnn); return;
+		case 0xB0: snprintf(out, size, "JP   V0, %03X", nnn); return;
+		case 0xC0: snprintf(out, size, "RND  V%X, %02X", x, b); return;
+		case 0xD0: snprintf(out, size, "DRW  V%X, V%X, %X", x, y, n); return;
+		case 0xE0:
+			if(b == 0x9E) {
+				snprintf(out, size, "SKP  V%X", x);
+				return;
+			} else if(b == 0xA1) {
+				snprintf(out, size, "SKNP V%X", x);
+				return;
+			}
+			break;
+		case 0xF0:
+			switch(b) {
+				case 0x07: snprintf(out, size, "LD   V%X, DT", x); return;
+				case 0x0A: snprintf(out, size, "LD   V%X, K", x); return;
+				case 0x15: snprintf(out, size, "LD   DT, V%X", x); return;
+				case 0x18: snprintf(out, size, "LD   ST, V%X", x); return;
+				case 0x1E: snprintf(out, size, "ADD  I, V%X", x); return;
+				case 0x29: snprintf(out, size, "LD   F, V%X", x); return;
+				case 0x33: snprintf(out, size, "LD   B, V%X", x); return;
+				case 0x55: snprintf(out, size, "LD   [I], V%X", x); return;
+				case 0x65: snprintf(out, size, "LD   V%X, [I]", x); return;
+			}
+			break;
+	}
+
+	snprintf(out, size, "DW   %02X%02X", a, b);
+}
+
+#ifdef CHIP8_AOT
+/* Turns the compiled blocks covering addr back on once no breakpoint is left
+   in them and they still hold the bytes they were translated from. */
+void debugger_aot_restore(int addr)
+{
+	for(int i = 0; i < aot_block_count; i++) {
+		int start = aot_blocks[i].start, end = aot_blocks[i].end;
+		if(addr < start || addr >= end || !aot_code[start]) {
+			continue;
+		}
+
+		bool clear = memcmp(&memory[start], &aot_rom[start - 0x200], end - start) == 0;
+		for(int bp = start; bp < end && clear; bp++) {
+			clear = !bit_test(breakpoints, bp);
+		}
+		if(clear) {
+			aot_entry[start] = aot_blocks[i].run;
+		}
+	}
+}
+#endif
+
+void debugger_list(int addr, int count)
+{
+	char text[32];
+
+	for(int i = 0; i < count && addr >= 0 && addr < 0x1000; i++, addr += 2) {
+		disassemble(addr, text, sizeof(text));
+		printf("%c%c %03X: %02X%02X  %s\n", addr == PC ? '>' : ' ', bit_test(breakpoints, addr) ? '*' : ' ',
+			addr, memory[addr], memory[(addr + 1) & 0xFFF], text);
+	}
+}
+
+void debugger_prompt()
+{
+	char line[128];
+	long a, b;
+
+	debugger_break = false;
+	debugger_list(PC, 1);
+
+	while(true) {
+		printf("(chip8) ");
+		fflush(stdout);
+		if(fgets(line, sizeof(line), stdin) == NULL) {
+			exit(0);
+		}
+
+		char command[8] = {0}, access[4] = {0};
+		int fields = sscanf(line, "%7s %li %li", command, &a, &b);
+
+		if(fields <= 0 || strcmp(command, "s") == 0) {
+			debugger_steps = fields >= 2 && a > 0 ? a : 1;
+			return;
+		} else if(strcmp(command, "c") == 0) {
+			debugger_steps = 0;
+			return;
+		} else if(strcmp(command, "q") == 0) {
+			exit(0);
+		} else if(strcmp(command, "r") == 0) {
+			printf("PC: %03X  I: %03X  SP: %d  DT: %d  ST: %d\n", PC, ADDR, (int)sub_stack.size(), delay_timer, sound_timer);
+			print_registers();
+		} else if(strcmp(command, "l") == 0 && !(fields >= 2 && a < 0)) {
+			debugger_list(fields >= 2 ? a : PC, fields >= 3 ? b : 10);
+		} else if(strcmp(command, "x") == 0 && fields >= 2 && a >= 0) {
+			for(long i = 0; i < (fields >= 3 ? b : 16) && a + i < 0x1000; i++) {
+				if(i % 16 == 0) {
+					printf("%s%03lX:", i ? "\n" : "", a + i);
+				}
+				printf(" %02X", memory[a + i]);
+			}
+			printf("\n");
+		} else if((strcmp(command, "b") == 0 || strcmp(command, "d") == 0 || strcmp(command, "w") == 0 || strcmp(command, "dw") == 0)
+				&& fields >= 2 && (a < 0 || a >= 0x1000)) {
+			printf("address out of range, must be 000..FFF\n");
+		} else if(strcmp(command, "b") == 0 && fields >= 2) {
+			if(bit_set(breakpoints, a, true)) {
+				breakpoint_count++;
+#ifdef CHIP8_AOT
+				aot_invalidate(a);
+#endif
+			}
+		} else if(strcmp(command, "d") == 0 && fields >= 2) {
+			if(bit_set(breakpoints, a, false)) {
+				breakpoint_count--;
+#ifdef CHIP8_AOT
+				debugger_aot_restore(a);
+#endif
+			}
+		} else if(strcmp(command, "w") == 0 && fields >= 2) {
+			sscanf(line, "%*s %*s %3s", access);
+			bool reads = strchr(access, 'r') != NULL || access[0] == 0;
+			bool writes = strchr(access, 'w') != NULL || access[0] == 0;
+			watchpoint_count += bit_set(watch_reads, a, reads) ? (reads ? 1 : -1) : 0;
+			watchpoint_count += bit_set(watch_writes, a, writes) ? (writes ? 1 : -1) : 0;
+		} else if(strcmp(command, "dw") == 0 && fields >= 2) {
+			watchpoint_count -= bit_set(watch_reads, a, false) ? 1 : 0;
+			watchpoint_count -= bit_set(watch_writes, a, false) ? 1 : 0;
+		} else if(strcmp(command, "i") == 0) {
+			for(int addr = 0; addr < 0x1000; addr++) {
+				if(bit_test(breakpoints, addr)) {
+					printf("breakpoint %03X\n", addr);
+				}
+				if(bit_test(watch_reads, addr) || bit_test(watch_writes, addr)) {
+					printf("watchpoint %03X %s%s\n", addr, bit_test(watch_reads, addr) ? "r" : "", bit_test(watch_writes, addr) ? "w" : "");
+				}
+			}
+		} else {
+			printf("s [N]          step N instructions (also an empty line)\n"
+			       "c              continue\n"
+			       "b ADDR, d ADDR set or delete a breakpoint\n"
+			       "w ADDR [r|w|rw], dw ADDR\n"
+			       "               set or delete a memory watchpoint\n"
+			       "i              list breakpoints and watchpoints\n"
+			       "l [ADDR [N]]   disassemble\n"
+			       "x ADDR [LEN]   dump memory\n"
+			       "r              show registers\n"
+			       "q              quit\n");
+		}
+	}
+}
+#endif
+
+/* Finishes a pending FX0A once a key is in: a key press seen by the main
+   loop, or a key held through the control socket. */
+void key_wait_poll()
+{
+	for(int key = 0; key <= 0xF && control_keys != 0 && key_press < 0; key++) {
+		if(control_keys >> key & 0x1) {
+			key_press = key;
+		}
+	}
+
+	if(key_press >= 0) {
+		REG(key_wait_register) = key_press;
+		waiting_for_key = false;
+	}
+}
+
 void execute(OpCode op, Instruction inst, uint32_t* pixels)
 {
 	uint8_t high = inst.a & 0xF0;
@@ -266,7 +1174,7 @@ void execute(OpCode op, Instruction inst, uint32_t* pixels)
 		break;
 		case OP_0NNN: {
 			DEBUG_PRINT("Looks like this program uses an annoying instruction.\n");
-			assert(false);
+			bad_instruction(inst);
 		}
 		break;
 		case OP_00EE: {
@@ -436,7 +1344,7 @@ void execute(OpCode op, Instruction inst, uint32_t* pixels)
 			uint8_t X = REG(low);
 			uint8_t Y = REG((inst.b & 0xF0) >> 4);
 
-			if(REG(X) != REG(Y)) {
+			if(X != Y) {
 				PC+=2;
 				DEBUG_PRINT("Incrementing PC by two.\n");
 			}
@@ -455,6 +1363,11 @@ void execute(OpCode op, Instruction inst, uint32_t* pixels)
 			uint8_t Y = REG((inst.b & 0xF0) >> 4);
 			uint8_t N = inst.b & 0xF;
 			VF = 0;
+#if DEBUGGER
+			if(watchpoint_count > 0) {
+				watch_check(watch_reads, ADDR, N, "read");
+			}
+#endif
 			DEBUG_PRINT("Drawing sprite 8x%d at %02Xx%02X\n", N, X, Y);
 
 			for (int y = 0; y < N; ++y)
@@ -497,6 +1410,7 @@ void execute(OpCode op, Instruction inst, uint32_t* pixels)
 			skip = skip || (reg_val == 0xD && key_state[SDL_SCANCODE_D]);
 			skip = skip || (reg_val == 0xE && key_state[SDL_SCANCODE_E]);
 			skip = skip || (reg_val == 0xF && key_state[SDL_SCANCODE_F]);
+			skip = skip || (reg_val <= 0xF && (control_keys >> reg_val & 0x1));
 
 			if(skip) {
 				PC+=2;
@@ -521,6 +1435,7 @@ void execute(OpCode op, Instruction inst, uint32_t* pixels)
 			skip = skip || (reg_val == 0xD && !key_state[SDL_SCANCODE_D]);
 			skip = skip || (reg_val == 0xE && !key_state[SDL_SCANCODE_E]);
 			skip = skip || (reg_val == 0xF && !key_state[SDL_SCANCODE_F]);
+			skip = skip && !(reg_val <= 0xF && (control_keys >> reg_val & 0x1));
 
 			if(skip) {
 				PC+=2;
@@ -530,84 +1445,12 @@ void execute(OpCode op, Instruction inst, uint32_t* pixels)
 			REG(low) = delay_timer;
 		} break;
 		case OP_FX0A: { /* Wait for a key press, store the value of the key in Vx. */
-
-			SDL_Event event;
-			bool has_keypressevent = false;
-
-			while(!has_keypressevent) {
-				if(SDL_WaitEvent(&event) && event.type == SDL_KEYDOWN) {
-					switch(event.key.keysym.scancode) {
-						case SDL_SCANCODE_0:
-						REG(low) = 0x0;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_1:
-						REG(low) = 0x1;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_2:
-						REG(low) = 0x2;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_3:
-						REG(low) = 0x3;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_4:
-						REG(low) = 0x4;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_5:
-						REG(low) = 0x5;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_6:
-						REG(low) = 0x6;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_7:
-						REG(low) = 0x7;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_8:
-						REG(low) = 0x8;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_9:
-						REG(low) = 0x9;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_A:
-						REG(low) = 0xA;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_B:
-						REG(low) = 0xB;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_C:
-						REG(low) = 0xC;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_D:
-						REG(low) = 0xD;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_E:
-						REG(low) = 0xE;
-						has_keypressevent = true;
-						break;
-						case SDL_SCANCODE_F:
-						REG(low) = 0xF;
-						has_keypressevent = true;
-						break;
-						default:
-							break;
-					}
-				}
-			}
-			
-			
+			/* Never blocks: the main loop holds off dispatching until a key comes
+			   in (see key_wait_poll) and keeps handling events and commands. */
+			waiting_for_key = true;
+			key_wait_register = low;
+			key_press = -1;
+			key_wait_poll();
 		} break;
 		case OP_FX15: {
 			delay_timer = REG(low);
@@ -623,26 +1466,49 @@ void execute(OpCode op, Instruction inst, uint32_t* pixels)
 		} break;
 		case OP_FX33: {
 			uint8_t val_in_reg = REG(low);
+#if DEBUGGER
+			if(watchpoint_count > 0) {
+				watch_check(watch_writes, ADDR, 3, "write");
+			}
+#endif
 
 			memory[ADDR] = (uint8_t) ((uint8_t) val_in_reg / 100);
 			memory[ADDR + 1] = (uint8_t) ((uint8_t) (val_in_reg / 10) % 10);
 			memory[ADDR + 2] = (uint8_t) ((uint8_t) (val_in_reg % 100) % 10);
+#ifdef CHIP8_AOT
+			aot_invalidate(ADDR);
+			aot_invalidate(ADDR + 1);
+			aot_invalidate(ADDR + 2);
+#endif
 		} break;
 		case OP_FX55: {
+#if DEBUGGER
+			if(watchpoint_count > 0) {
+				watch_check(watch_writes, ADDR, low + 1, "write");
+			}
+#endif
 			for(int i = 0; i <= low; i++) {
 				memory[ADDR + i] = registers[i];
+#ifdef CHIP8_AOT
+				aot_invalidate(ADDR + i);
+#endif
 			}
 			ADDR += low + 1;
 		} break;
 		case OP_FX65: {
+#if DEBUGGER
+			if(watchpoint_count > 0) {
+				watch_check(watch_reads, ADDR, low + 1, "read");
+			}
+#endif
 			for(int i = 0; i <= low; i++) {
 				registers[i] = memory[ADDR + i];
 			}
 			ADDR += low + 1;
 		} break;
 	default:
-		printf("Instruction isnt implemented yet.\n");
-		assert(false);
+		fprintf(stderr, "Instruction isnt implemented yet.\n");
+		bad_instruction(inst);
 		break;
 	}
 }
@@ -666,10 +1532,69 @@ uint8_t font[80] =
 		0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-int main(void) {
-	srand(time(NULL));
+/* The timers count instructions, blocks run several at once. */
+void tick_timers(int count)
+{
+	delay_timer = delay_timer > count ? delay_timer - count : 0;
+	if(sound_timer > 0) {
+		if(benchmark_instructions == 0) {
+			BEEP;
+		}
+		sound_timer = sound_timer > count ? sound_timer - count : 0;
+	}
+}
+
+int main(int argc, char** argv) {
+#ifdef CHIP8_AOT
+	const char* rom_path = aot_rom_path;
+#else
+	const char* rom_path = "roms/PONG";
+#endif
+	const char* capture_path = NULL;
+	const char* control_path = NULL;
+	unsigned int seed = time(NULL);
+	bool seeded = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, DEBUGGER ? "b:c:s:r:d" : "b:c:s:r:")) != -1) {
+		switch(opt) {
+			case 'c':
+				capture_path = optarg;
+				break;
+			case 's':
+				control_path = optarg;
+				break;
+			case 'b':
+				benchmark_instructions = strtol(optarg, NULL, 0);
+				break;
+			case 'r':
+				seed = strtoul(optarg, NULL, 0);
+				seeded = true;
+				break;
+#if DEBUGGER
+			case 'd':
+				debugger_break = true;
+				break;
+#endif
+			default:
+				fprintf(stderr, "usage: %s [-b instructions] [-c capture.y4m] [-r seed] [-s control.sock]%s [rom]\n", argv[0], DEBUGGER ? " [-d]" : "");
+				return 1;
+		}
+	}
+	if(optind < argc) {
+		rom_path = argv[optind];
+	}
 
-	int rom_size;
+	/* captures are meant to be diffed against earlier runs, so they get a fixed seed */
+	if(capture_path != NULL && !seeded) {
+		seed = 0;
+	}
+	srand(seed);
+	/* keep stdout clean in case the capture is going to it */
+	FILE* info = capture_path != NULL ? stderr : stdout;
+	fprintf(info, "seed: %u\n", seed);
+
+	int rom_size = 0;
 	memset(memory, 0, sizeof(memory));
 
 	memcpy(memory, font, sizeof(font));
@@ -681,13 +1606,18 @@ int main(void) {
 	//ReadRom("roms/trip8.ch8", &memory[0x200], rom_size);
 	//ReadRom("roms/particle.ch8", &memory[0x200], rom_size);
 	//ReadRom("roms/INVADERS", &memory[0x200], rom_size);
-	ReadRom("roms/PONG", &memory[0x200], rom_size);
+	//ReadRom("roms/PONG", &memory[0x200], rom_size);
+	ReadRom(rom_path, &memory[0x200], rom_size);
 	//ReadRom("roms/picture.ch8", &memory[0x200], rom_size);
 	PC=0x200;
 
+#ifdef CHIP8_AOT
+	aot_load(rom_size);
+#endif
+
 	//assert(rom_size % 2 == 0);
 
-	printf("rom size: %d\n", rom_size);
+	fprintf(info, "rom size: %d\n", rom_size);
 
 	SDL_Init(SDL_INIT_VIDEO);
 	int windowWidth = 800, windowHeight = 600;
@@ -700,22 +1630,85 @@ int main(void) {
 
 	screen_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
 
-	pixels = (uint32_t*)malloc(WIDTH*HEIGHT*4);
+	pixels = (uint32_t*)calloc(WIDTH*HEIGHT, 4);
+
+	if(capture_path != NULL && !capture_open(capture_path)) {
+		return 1;
+	}
+	if(control_path != NULL && !control_open(control_path)) {
+		return 1;
+	}
+
+	timespec benchmark_start;
+	clock_gettime(CLOCK_MONOTONIC, &benchmark_start);
 
 	while(1) {
-		Instruction inst = fetch(PC);
-		OpCode op = decode(inst);
-		execute(op, inst, pixels);
+		int executed = 0;
 
-		if(delay_timer > 0) {
-			delay_timer--;
+		if(control_pending.load(std::memory_order_relaxed) || (waiting_for_key && !control_deferred.empty())) {
+			control_service();
 		}
-		if(sound_timer > 0) {
-			BEEP;
-			sound_timer--;
+
+		if(waiting_for_key) {
+			key_wait_poll();
+		}
+
+		if(waiting_for_key) {
+			/* nothing is dispatched, counted or stepped, but time goes on */
+			if(!paused) {
+				tick_timers(1);
+			}
+		} else if(!paused || step_budget > 0) {
+			executed = 1;
+
+#if DEBUGGER
+			if(debugger_break || (breakpoint_count > 0 && bit_test(breakpoints, PC))) {
+				debugger_prompt();
+			}
+#endif
+
+#ifdef CHIP8_AOT
+			/* stepping goes one instruction at a time, so through the interpreter */
+			bool single_step = paused;
+#if DEBUGGER
+			single_step = single_step || debugger_steps > 0;
+#endif
+			if(!single_step && PC >= 0 && PC < 0x1000 && aot_entry[PC] != NULL) {
+				executed = aot_entry[PC]();
+				blocks_dispatched++;
+			} else
+#endif
+			{
+				Instruction inst = fetch(PC);
+				OpCode op = decode(inst);
+				execute(op, inst, pixels);
+				PC += 2;
+			}
+			instructions_executed += executed;
+
+#if DEBUGGER
+			if(debugger_steps > 0 && --debugger_steps == 0) {
+				debugger_break = true;
+			}
+#endif
+
+			tick_timers(executed);
+
+			if(paused && --step_budget == 0) {
+				control_step_done();
+			}
+
+			if(benchmark_instructions > 0 && instructions_executed >= (uint64_t)benchmark_instructions) {
+				timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				double seconds = (now.tv_sec - benchmark_start.tv_sec) + (now.tv_nsec - benchmark_start.tv_nsec) / 1e9;
+				fprintf(capture_file != NULL ? stderr : stdout, "benchmark: %llu instructions, %llu blocks, %.3f s, %.1f M instructions/s\n",
+					(unsigned long long)instructions_executed, (unsigned long long)blocks_dispatched,
+					seconds, instructions_executed / seconds / 1e6);
+				exit(0);
+			}
 		}
 
-		PC += 2;
 		//getchar();
 
 		SDL_Event event;
@@ -728,12 +1721,22 @@ int main(void) {
 					if(event.key.keysym.scancode == SDL_SCANCODE_ESCAPE) {
 					exit(0);
 					}
+					if(waiting_for_key && key_from_scancode(event.key.keysym.scancode) >= 0) {
+						key_press = key_from_scancode(event.key.keysym.scancode);
+					}
+#if DEBUGGER
+					if(event.key.keysym.scancode == SDL_SCANCODE_F1) {
+						debugger_break = true;
+					}
+#endif
 				}
 				break;
 			}
 		}
 
-		usleep(1500);
+		if(benchmark_instructions == 0) {
+			usleep(1500 * (executed > 0 ? executed : 1));
+		}
 	}
 
     return 0;
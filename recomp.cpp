@@ -0,0 +1,328 @@
+/* Static recompiler.
+   Walks a ROM from 0x200, recovers its basic blocks from the jump, call, return
+   and skip instructions, and writes them out as C++ functions that main.cpp is
+   built with (see the aot target in the makefile).
+
+   Only instructions that touch nothing but registers, I and the call stack are
+   translated. Anything else (drawing, keys, timers, memory stores, BNNN) ends
+   the block and is left to the interpreter. The translations mirror execute()
+   in main.cpp exactly, quirks included, so both paths give the same results. */
+#include <stdio.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#define ROM_START 0x200
+#define MEMORY_SIZE 0x1000
+
+uint8_t memory[MEMORY_SIZE] = {0};
+int rom_end = ROM_START;
+
+enum Kind {
+KIND_STRAIGHT,		/* translated, falls through to the next instruction */
+KIND_SKIP,			/* translated, continues at +2 or +4 */
+KIND_JUMP,			/* 1NNN */
+KIND_CALL,			/* 2NNN */
+KIND_RETURN,		/* 00EE */
+KIND_INTERP,		/* left to the interpreter, continues at +2 */
+KIND_INTERP_SKIP,	/* left to the interpreter, continues at +2 or +4 */
+KIND_STOP,			/* unknown or unresolvable, nothing is known past it */
+};
+
+struct Block {
+	int start, end;
+	std::vector<int> body;
+};
+
+Kind classify(int pc)
+{
+	if(pc < ROM_START || pc + 1 >= rom_end) {
+		return KIND_STOP;
+	}
+
+	uint8_t a = memory[pc], b = memory[pc+1];
+	uint8_t low = a & 0xF;
+
+	switch(a & 0xF0) {
+		case 0x00:
+			if(low == 0x0 && b == 0xE0) {
+				return KIND_INTERP;
+			} else if(low == 0x0 && b == 0xEE) {
+				return KIND_RETURN;
+			}
+			return KIND_STOP;
+		case 0x10:
+			return KIND_JUMP;
+		case 0x20:
+			return KIND_CALL;
+		case 0x30:
+		case 0x40:
+		case 0x50:
+		case 0x90:
+			return KIND_SKIP;
+		case 0x60:
+		case 0x70:
+		case 0xA0:
+		case 0xC0:
+			return KIND_STRAIGHT;
+		case 0x80:
+			switch(b & 0xF) {
+				case 0x0: case 0x1: case 0x2: case 0x3: case 0x4:
+				case 0x5: case 0x6: case 0x7: case 0xE:
+					return KIND_STRAIGHT;
+			}
+			return KIND_STOP;
+		case 0xD0:
+			return KIND_INTERP;
+		case 0xE0:
+			if(b == 0x9E || b == 0xA1) {
+				return KIND_INTERP_SKIP;
+			}
+			return KIND_STOP;
+		case 0xF0:
+			switch(b) {
+				case 0x1E: case 0x29:
+					return KIND_STRAIGHT;
+				case 0x07: case 0x0A: case 0x15: case 0x18:
+				case 0x33: case 0x55: case 0x65:
+					return KIND_INTERP;
+			}
+			return KIND_STOP;
+	}
+
+	/* BNNN is not resolvable ahead of time */
+	return KIND_STOP;
+}
+
+void emit_instruction(FILE* out, int pc)
+{
+	uint8_t a = memory[pc], b = memory[pc+1];
+	int x = a & 0xF;
+	int y = (b & 0xF0) >> 4;
+	int nnn = b | x << 8;
+
+	fprintf(out, "\t/* %03X: %02X%02X */\n", pc, a, b);
+
+	switch(a & 0xF0) {
+		case 0x00: /* 00EE */
+			fprintf(out, "\tPC = sub_stack.top() + 2;\n\tsub_stack.pop();\n");
+			break;
+		case 0x10:
+			fprintf(out, "\tPC = 0x%03X;\n", nnn);
+			break;
+		case 0x20:
+			fprintf(out, "\tsub_stack.push(0x%03X);\n\tPC = 0x%03X;\n", pc, nnn);
+			break;
+		case 0x30:
+			fprintf(out, "\tPC = registers[0x%X] == 0x%02X ? 0x%03X : 0x%03X;\n", x, b, pc + 4, pc + 2);
+			break;
+		case 0x40:
+			fprintf(out, "\tPC = registers[0x%X] != 0x%02X ? 0x%03X : 0x%03X;\n", x, b, pc + 4, pc + 2);
+			break;
+		case 0x50:
+			fprintf(out, "\tPC = registers[0x%X] == registers[0x%X] ? 0x%03X : 0x%03X;\n", x, y, pc + 4, pc + 2);
+			break;
+		case 0x90:
+			fprintf(out, "\tPC = registers[0x%X] != registers[0x%X] ? 0x%03X : 0x%03X;\n", x, y, pc + 4, pc + 2);
+			break;
+		case 0x60:
+			fprintf(out, "\tregisters[0x%X] = 0x%02X;\n", x, b);
+			break;
+		case 0x70:
+			fprintf(out, "\tregisters[0x%X] += 0x%02X;\n", x, b);
+			break;
+		case 0xA0:
+			fprintf(out, "\tADDR = 0x%03X;\n", nnn);
+			break;
+		case 0xC0:
+			fprintf(out, "\tregisters[0x%X] = (uint8_t)(rand() %% 0xFF) & 0x%02X;\n", x, b);
+			break;
+		case 0x80:
+			switch(b & 0xF) {
+				case 0x0:
+					fprintf(out, "\tregisters[0x%X] = registers[0x%X];\n", x, y);
+					break;
+				case 0x1:
+					fprintf(out, "\tregisters[0x%X] |= registers[0x%X];\n", x, y);
+					break;
+				case 0x2:
+					fprintf(out, "\tregisters[0x%X] &= registers[0x%X];\n", x, y);
+					break;
+				case 0x3:
+					fprintf(out, "\tregisters[0x%X] ^= registers[0x%X];\n", x, y);
+					break;
+				case 0x4:
+					fprintf(out, "\t{\n\t\tuint32_t sum = registers[0x%X] + registers[0x%X];\n", y, x);
+					fprintf(out, "\t\tregisters[0xF] = sum > 0xFF ? 0x01 : 0x0;\n");
+					fprintf(out, "\t\tregisters[0x%X] = sum;\n\t}\n", x);
+					break;
+				case 0x5:
+					fprintf(out, "\tregisters[0xF] = registers[0x%X] < registers[0x%X] ? 0 : 0x01;\n", x, y);
+					fprintf(out, "\tregisters[0x%X] -= registers[0x%X];\n", x, y);
+					break;
+				case 0x6:
+					fprintf(out, "\tregisters[0xF] = registers[0x%X] & 0x1;\n", y);
+					fprintf(out, "\tregisters[0x%X] = registers[0x%X] >> 1;\n", x, y);
+					break;
+				case 0x7:
+					fprintf(out, "\tregisters[0xF] = registers[0x%X] < registers[0x%X] ? 0 : 0x01;\n", x, y);
+					fprintf(out, "\tregisters[0x%X] = registers[0x%X] - registers[0x%X];\n", x, y, x);
+					break;
+				case 0xE:
+					fprintf(out, "\tregisters[0xF] = registers[0x%X] & 0xFF;\n", y);
+					fprintf(out, "\tregisters[0x%X] = registers[0x%X] << 1;\n", x, y);
+					break;
+			}
+			break;
+		case 0xF0:
+			if(b == 0x1E) {
+				fprintf(out, "\tADDR += registers[0x%X];\n", x);
+			} else { /* FX29 */
+				fprintf(out, "\tADDR = registers[0x%X] * 0x5;\n", x);
+			}
+			break;
+	}
+}
+
+/* Follow straight-line code from start, queueing every address control can
+   reach from the instruction that ends the block. */
+Block discover(int start, std::vector<int>& worklist)
+{
+	Block block;
+	block.start = start;
+
+	int pc = start;
+	while(true) {
+		Kind kind = classify(pc);
+		int nnn = memory[pc+1] | (memory[pc] & 0xF) << 8;
+
+		switch(kind) {
+			case KIND_STRAIGHT:
+				block.body.push_back(pc);
+				pc += 2;
+				continue;
+			case KIND_SKIP:
+				block.body.push_back(pc);
+				worklist.push_back(pc + 2);
+				worklist.push_back(pc + 4);
+				break;
+			case KIND_JUMP:
+				block.body.push_back(pc);
+				worklist.push_back(nnn);
+				break;
+			case KIND_CALL:
+				block.body.push_back(pc);
+				worklist.push_back(nnn);
+				worklist.push_back(pc + 2);
+				break;
+			case KIND_RETURN:
+				block.body.push_back(pc);
+				break;
+			case KIND_INTERP_SKIP:
+				worklist.push_back(pc + 4);
+				/* fall through */
+			case KIND_INTERP:
+				worklist.push_back(pc + 2);
+				break;
+			case KIND_STOP:
+				break;
+		}
+
+		block.end = block.body.empty() ? start : block.body.back() + 2;
+		return block;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if(argc != 3) {
+		fprintf(stderr, "usage: %s rom output.cpp\n", argv[0]);
+		return 1;
+	}
+
+	std::ifstream ifs(argv[1], std::ifstream::binary);
+	if(!ifs) {
+		perror(argv[1]);
+		return 1;
+	}
+	ifs.read((char*)&memory[ROM_START], MEMORY_SIZE - ROM_START);
+	rom_end = ROM_START + ifs.gcount();
+
+	std::map<int, Block> blocks;
+	std::vector<int> worklist;
+	std::vector<bool> visited(MEMORY_SIZE, false);
+	worklist.push_back(ROM_START);
+
+	while(!worklist.empty()) {
+		int pc = worklist.back();
+		worklist.pop_back();
+
+		if(pc < ROM_START || pc >= rom_end || visited[pc]) {
+			continue;
+		}
+		visited[pc] = true;
+
+		Block block = discover(pc, worklist);
+		if(!block.body.empty()) {
+			blocks[pc] = block;
+		}
+	}
+
+	FILE* out = fopen(argv[2], "w");
+	if(out == NULL) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	fprintf(out, "/* Generated by recomp, do not edit. */\n\n");
+
+	for(auto& entry : blocks) {
+		Block& block = entry.second;
+		int last = block.body.back();
+
+		fprintf(out, "static int aot_block_%03X()\n{\n", block.start);
+		for(int pc : block.body) {
+			emit_instruction(out, pc);
+		}
+
+		Kind kind = classify(last);
+		if(kind == KIND_STRAIGHT) {
+			/* the instruction after the block is left to the interpreter */
+			fprintf(out, "\tPC = 0x%03X;\n", last + 2);
+		}
+		fprintf(out, "\treturn %d;\n}\n\n", (int)block.body.size());
+	}
+
+	fprintf(out, "const char* aot_rom_path = \"");
+	for(const char* c = argv[1]; *c != 0; c++) {
+		if(*c == '"' || *c == '\\') {
+			fprintf(out, "\\%c", *c);
+		} else if(isprint((unsigned char)*c)) {
+			fputc(*c, out);
+		} else {
+			/* octal, so a following digit can't extend the escape */
+			fprintf(out, "\\%03o", (unsigned char)*c);
+		}
+	}
+	fprintf(out, "\";\n");
+	fprintf(out, "const int aot_rom_size = %d;\n", rom_end - ROM_START);
+	fprintf(out, "const uint8_t aot_rom[] = {");
+	for(int i = ROM_START; i < rom_end; i++) {
+		fprintf(out, "%s0x%02X,", (i - ROM_START) % 16 == 0 ? "\n\t" : " ", memory[i]);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "const AotBlock aot_blocks[] = {\n");
+	for(auto& entry : blocks) {
+		Block& block = entry.second;
+		fprintf(out, "\t{0x%03X, 0x%03X, aot_block_%03X},\n", block.start, block.end, block.start);
+	}
+	fprintf(out, "};\nconst int aot_block_count = %d;\n", (int)blocks.size());
+
+	fclose(out);
+
+	printf("%s: %d blocks\n", argv[1], (int)blocks.size());
+	return 0;
+}